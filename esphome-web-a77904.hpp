@@ -5,6 +5,10 @@
 #include <cstdlib>
 
 #include <esp_task_wdt.h>
+#ifdef CUSTOMCODE_PROFILE
+#include <esp_timer.h>
+#include <esp_idf_version.h>
+#endif
 
 #include "esphome/components/json/json_util.h"
 #include "esphome/components/display/display.h"
@@ -23,6 +27,20 @@ std::vector<std::time_t> helper_calendar_range(const std::tm& in, bool fullrange
 std::string strftime(const char* format, const std::time_t& t, bool gmt=false);
 time_t parse_iso_date_to_local(const char* str);
 
+// Stage profiling, build with -DCUSTOMCODE_PROFILE to enable
+#ifdef CUSTOMCODE_PROFILE
+void profile_begin(const char* stage);
+void profile_end(size_t items, size_t bytes=0);
+void profile_sample();
+#define PROFILE_BEGIN(stage) profile_begin(stage)
+#define PROFILE_END(...) profile_end(__VA_ARGS__)
+#define PROFILE_SAMPLE() profile_sample()
+#else
+#define PROFILE_BEGIN(stage)
+#define PROFILE_END(...)
+#define PROFILE_SAMPLE()
+#endif
+
 struct CalendarEvent {
     std::time_t start;
     std::time_t end;
@@ -39,9 +57,8 @@ struct Forecast {
     std::string condition;
 };
 
-std::vector<CalendarEvent> extract_json_calendar_events() {
+std::vector<CalendarEvent> extract_json_calendar_events(const std::string& calendar_json) {
     std::vector<CalendarEvent> ret;
-    std::string& calendar_json = id(sensor_calendar).state;
     if (1 < calendar_json.length()) {
         esphome::json::parse_json(calendar_json.c_str(), [&](JsonObject root) {
             for (JsonPair cal : root) {
@@ -59,6 +76,7 @@ std::vector<CalendarEvent> extract_json_calendar_events() {
                     ret.push_back(add);
                 }
             }
+            PROFILE_SAMPLE();
             return true;
         });
     }
@@ -66,9 +84,8 @@ std::vector<CalendarEvent> extract_json_calendar_events() {
     return ret;
 }
 
-std::vector<Forecast> extract_json_forecast(esphome::text_sensor::TextSensor& sensor) {
+std::vector<Forecast> extract_json_forecast(const std::string& forecast_json) {
     std::vector<Forecast> ret;
-    std::string& forecast_json = sensor.state;
     std::string wrapper = "{\"d\":" + forecast_json + "}";
     if (1 < forecast_json.length()) {
         esphome::json::parse_json(wrapper.c_str(), [&](JsonObject root) {
@@ -91,6 +108,7 @@ std::vector<Forecast> extract_json_forecast(esphome::text_sensor::TextSensor& se
                 }
                 ret.push_back(add);
             }
+            PROFILE_SAMPLE();
             return true;
         });
     }
@@ -98,9 +116,8 @@ std::vector<Forecast> extract_json_forecast(esphome::text_sensor::TextSensor& se
     return ret;
 }
 
-std::vector<std::string> extract_json_tasks() {
+std::vector<std::string> extract_json_tasks(const std::string& tasks_json) {
     std::vector<std::string> ret;
-    std::string& tasks_json = id(sensor_tasks).state;
     std::string wrapper = "{\"d\":" + tasks_json + "}";
     if (1 < tasks_json.length()) {
         esphome::json::parse_json(wrapper.c_str(), [&](JsonObject root) {
@@ -109,6 +126,7 @@ std::vector<std::string> extract_json_tasks() {
                     ret.push_back(fc["subject"].as<std::string>());
                 }
             }
+            PROFILE_SAMPLE();
             return true;
         });
     }
@@ -598,14 +616,22 @@ void render_page1(esphome::display::Display& it) {
     uint8_t now_min = now->tm_min;
 
     std::vector<std::time_t> calendar = helper_calendar_range(*now, true);
-    std::vector<CalendarEvent> events = extract_json_calendar_events();
-    std::vector<Forecast> forecast_hourly = extract_json_forecast(id(sensor_weather_forecast_hourly));
-    std::vector<std::string> tasks = extract_json_tasks();
+    PROFILE_BEGIN("page1.extract_calendar");
+    std::vector<CalendarEvent> events = extract_json_calendar_events(id(sensor_calendar).state);
+    PROFILE_END(events.size(), id(sensor_calendar).state.length());
+    PROFILE_BEGIN("page1.extract_forecast_hourly");
+    std::vector<Forecast> forecast_hourly = extract_json_forecast(id(sensor_weather_forecast_hourly).state);
+    PROFILE_END(forecast_hourly.size(), id(sensor_weather_forecast_hourly).state.length());
+    PROFILE_BEGIN("page1.extract_tasks");
+    std::vector<std::string> tasks = extract_json_tasks(id(sensor_tasks).state);
+    PROFILE_END(tasks.size(), id(sensor_tasks).state.length());
 
     it.fill(WHITE);
 
     render_calendar_today(it, 160, 54, now_year, now_month, now_mday, now_wday); //Center aligned
+    PROFILE_BEGIN("page1.render_calendar");
     render_calendar_calendar(it, 300, 20, calendar, events, now_month, now_mday, now_wday);
+    PROFILE_END(events.size());
 
     render_weather_current(it, 20, 300, 
         id(sensor_weather_now_temperature).state, id(sensor_weather_daily_temperature_low).state, id(sensor_weather_daily_temperature_high).state, 
@@ -614,7 +640,9 @@ void render_page1(esphome::display::Display& it) {
     render_weather_forecast_hourly(it, 300, 324, nowt, forecast_hourly);
     it.print(20, 460, &id(verdana_22), BLACK, TextAlign::TOP_LEFT, capitalize(id(sensor_weather_now_text).state).c_str());
     
+    PROFILE_BEGIN("page1.render_tasks");
     render_tasks(it, 20, 486, nowt, calendar, events, tasks);
+    PROFILE_END(events.size() + tasks.size());
 
     it.filled_rectangle(0, 720, 80, 80, WHITE);
     it.qr_code(10, 730, &id(wifi_qr), BLACK, 2); // ~60px
@@ -632,8 +660,12 @@ void render_page2(esphome::display::Display& it) {
 
     it.fill(WHITE);
 
-    std::vector<Forecast> forecast_hourly = extract_json_forecast(id(sensor_weather_forecast_hourly));
-    std::vector<Forecast> forecast_daily = extract_json_forecast(id(sensor_weather_forecast_daily));
+    PROFILE_BEGIN("page2.extract_forecast_hourly");
+    std::vector<Forecast> forecast_hourly = extract_json_forecast(id(sensor_weather_forecast_hourly).state);
+    PROFILE_END(forecast_hourly.size(), id(sensor_weather_forecast_hourly).state.length());
+    PROFILE_BEGIN("page2.extract_forecast_daily");
+    std::vector<Forecast> forecast_daily = extract_json_forecast(id(sensor_weather_forecast_daily).state);
+    PROFILE_END(forecast_daily.size(), id(sensor_weather_forecast_daily).state.length());
 
     render_weather_current(it, 20, 20, 
         id(sensor_weather_now_temperature).state, id(sensor_weather_daily_temperature_low).state, id(sensor_weather_daily_temperature_high).state, 
@@ -642,7 +674,9 @@ void render_page2(esphome::display::Display& it) {
     render_weather_forecast_hourly(it, 300, 44, nowt, forecast_hourly);
     it.print(20, 180, &id(verdana_22), BLACK, TextAlign::TOP_LEFT, capitalize(id(sensor_weather_now_text).state).c_str());
 
+    PROFILE_BEGIN("page2.render_forecast_daily");
     render_weather_forecast_daily(it, 20, 220, nowt, forecast_daily);
+    PROFILE_END(forecast_daily.size());
 
 
     it.print(20, 535, &id(verdanab_22), BLACK, TextAlign::TOP_LEFT, "WIFI");
@@ -669,4 +703,280 @@ void boot() {
     esp_task_wdt_init(&wdt_config);
 }
 
+#ifdef CUSTOMCODE_PROFILE
+
+// Limits for the sweep, a stage fails if it is slower or leaves less free heap than this
+#ifndef CUSTOMCODE_PROFILE_MAX_STAGE_US
+#define CUSTOMCODE_PROFILE_MAX_STAGE_US 5000000
+#endif
+#ifndef CUSTOMCODE_PROFILE_MIN_FREE_HEAP
+#define CUSTOMCODE_PROFILE_MIN_FREE_HEAP 65536
+#endif
+
+// Local minimum tracking of the allocator, otherwise only sampled in the json callbacks
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 3, 0)
+#define CUSTOMCODE_PROFILE_LOCAL_MINIMUM
+#endif
+
+struct StageProfile {
+    const char* stage;
+    int64_t start_us;
+    int64_t elapsed_us;
+    size_t heap_before;
+    size_t heap_low;
+};
+
+static StageProfile profile_current{};
+
+void profile_sample() {
+    size_t heap_free = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    if (heap_free < profile_current.heap_low) {
+        profile_current.heap_low = heap_free;
+    }
+}
+
+void profile_begin(const char* stage) {
+    profile_current = StageProfile{};
+    profile_current.stage = stage;
+    profile_current.heap_before = heap_caps_get_free_size(MALLOC_CAP_8BIT);
+    profile_current.heap_low = profile_current.heap_before;
+#ifdef CUSTOMCODE_PROFILE_LOCAL_MINIMUM
+    heap_caps_monitor_local_minimum_free_size_start();
+#endif
+    profile_current.start_us = esp_timer_get_time();
+}
+
+// heap_stage_low is the lowest free heap while the stage ran, heap_stage_peak is how much the stage used at most
+void profile_end(size_t items, size_t bytes) {
+    profile_current.elapsed_us = esp_timer_get_time() - profile_current.start_us;
+#ifdef CUSTOMCODE_PROFILE_LOCAL_MINIMUM
+    size_t local_minimum = heap_caps_get_minimum_free_size(MALLOC_CAP_8BIT);
+    heap_caps_monitor_local_minimum_free_size_stop();
+    if (local_minimum < profile_current.heap_low) {
+        profile_current.heap_low = local_minimum;
+    }
+#endif
+    profile_sample();
+    ESP_LOGI(TAG, "profile stage=%s items=%u bytes=%u time_us=%lld heap_free_before=%u heap_free_after=%u heap_stage_low=%u heap_stage_peak=%u heap_largest_after=%u",
+        profile_current.stage, (unsigned)items, (unsigned)bytes, (long long)profile_current.elapsed_us,
+        (unsigned)profile_current.heap_before, (unsigned)heap_caps_get_free_size(MALLOC_CAP_8BIT),
+        (unsigned)profile_current.heap_low, (unsigned)(profile_current.heap_before - profile_current.heap_low),
+        (unsigned)heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+}
+
+bool profile_check(size_t expected, size_t items) {
+    bool ok = true;
+    if (items != expected) {
+        ESP_LOGE(TAG, "profile fail stage=%s reason=items expected=%u items=%u", profile_current.stage, (unsigned)expected, (unsigned)items);
+        ok = false;
+    }
+    if (CUSTOMCODE_PROFILE_MAX_STAGE_US < profile_current.elapsed_us) {
+        ESP_LOGE(TAG, "profile fail stage=%s reason=time items=%u time_us=%lld", profile_current.stage, (unsigned)items, (long long)profile_current.elapsed_us);
+        ok = false;
+    }
+    if (profile_current.heap_low < CUSTOMCODE_PROFILE_MIN_FREE_HEAP) {
+        ESP_LOGE(TAG, "profile fail stage=%s reason=heap items=%u heap_stage_low=%u", profile_current.stage, (unsigned)items, (unsigned)profile_current.heap_low);
+        ok = false;
+    }
+    return ok;
+}
+
+// The generated json is kept together with the parsed document, do not start what would not fit
+bool profile_fits(const char* stage, size_t n, size_t bytes) {
+    size_t largest = heap_caps_get_largest_free_block(MALLOC_CAP_8BIT);
+    if (largest < bytes * 2 + CUSTOMCODE_PROFILE_MIN_FREE_HEAP) {
+        ESP_LOGE(TAG, "profile fail stage=%s reason=heap items=%u bytes=%u heap_largest=%u", stage, (unsigned)n, (unsigned)bytes, (unsigned)largest);
+        return false;
+    }
+    return true;
+}
+
+static const char* profile_calendars[] = {"calendar.calendar_o365", "calendar.kriszti_o365", "calendar.nevnap_o365", "calendar.szuletesnap_o365", "calendar.magyar_unnepnapok_o365"};
+static const char* profile_summaries[] = {
+    "Fogorvosi időpont", "Szülői értekezlet az iskolában", "Születésnapi ünnepség a nagyszülőknél",
+    "Negyedéves ügyfélmegbeszélés", "Bevásárlás a hétvégi főzéshez", "Öltözőszekrény összeszerelése",
+    "Úszásoktatás a gyerekeknek", "Fürdőszoba felújítás, kőműves érkezik", "Őszi kerti munkák", "Ügyintézés az okmányirodában"
+};
+static const char* profile_locations[] = {"Budapest, Kőbányai út 31.", "Győr, Árpád utca 12.", "Szeged, Tisza Lajos körút 5.", "Pécs, Széchenyi tér 1.", "Debrecen, Piac utca 20."};
+static const char* profile_conditions[] = {"sunny", "partlycloudy", "cloudy", "rainy", "pouring", "snowy", "fog", "clear-night"};
+static const size_t profile_calendar_event_bytes = 260;
+static const size_t profile_forecast_bytes = 140;
+static const size_t profile_task_bytes = 100;
+
+std::string profile_summary(size_t i) {
+    const size_t count = sizeof(profile_summaries) / sizeof(profile_summaries[0]);
+    std::string ret = profile_summaries[i % count];
+    ret += ", ";
+    ret += profile_summaries[(i * 7 + 3) % count];
+    ret += " (" + std::to_string(i) + ")";
+    return ret;
+}
+
+// Same shape as the calendar.get_events response, events are not in start order
+std::string profile_calendar_json(size_t n, std::time_t range_start, std::time_t range_end) {
+    static const std::time_t day = 86400;
+    const size_t calendars = sizeof(profile_calendars) / sizeof(profile_calendars[0]);
+    const size_t locations = sizeof(profile_locations) / sizeof(profile_locations[0]);
+    const size_t span_hours = (range_end - range_start) / 3600;
+    std::string ret;
+    ret.reserve(n * profile_calendar_event_bytes + 256);
+    ret += "{";
+    for (size_t c = 0; c < calendars; c++) {
+        ret += c ? ",\"" : "\"";
+        ret += profile_calendars[c];
+        ret += "\":{\"events\":[";
+        for (size_t i = c; i < n; i += calendars) {
+            std::time_t start = range_start + (i * 7919 % span_hours) * 3600;
+            ret += i == c ? "{" : ",{";
+            if (i % 5 == 4) {
+                ret += "\"start\":\"" + strftime("%Y-%m-%d", start) + "\",\"end\":\"" + strftime("%Y-%m-%d", start + day) + "\"";
+            } else {
+                std::time_t end = start + (i % 11 == 0 ? 2 * day : (1 + i % 3) * 3600);
+                ret += "\"start\":\"" + strftime("%Y-%m-%dT%H:%M:%S+00:00", start, true) + "\",\"end\":\"" + strftime("%Y-%m-%dT%H:%M:%S+00:00", end, true) + "\"";
+            }
+            ret += ",\"summary\":\"" + profile_summary(i) + "\"";
+            if (i % 2 == 1) {
+                ret += ",\"location\":\"";
+                ret += profile_locations[i % locations];
+                ret += "\"";
+            }
+            ret += "}";
+        }
+        ret += "]}";
+    }
+    ret += "}";
+    return ret;
+}
+
+// Same shape as the weather.get_forecasts forecast list, step is 3600 for hourly and 86400 for daily
+std::string profile_forecast_json(size_t n, std::time_t nowt, std::time_t step) {
+    const size_t conditions = sizeof(profile_conditions) / sizeof(profile_conditions[0]);
+    std::string ret;
+    ret.reserve(n * profile_forecast_bytes + 2);
+    ret += "[";
+    for (size_t i = 0; i < n; i++) {
+        char buf[160];
+        snprintf(buf, sizeof(buf), "%s{\"datetime\":\"%s\",\"condition\":\"%s\",\"temperature\":%.1f,\"templow\":%.1f,\"precipitation_probability\":%d}",
+            i ? "," : "", strftime("%Y-%m-%dT%H:%M:%S+00:00", nowt + (i + 1) * step, true).c_str(), profile_conditions[i % conditions],
+            (float)(i % 30) - 5.5f, (float)(i % 20) - 10.5f, (int)(i * 13 % 101));
+        ret += buf;
+    }
+    ret += "]";
+    return ret;
+}
+
+std::string profile_tasks_json(size_t n) {
+    std::string ret;
+    ret.reserve(n * profile_task_bytes + 2);
+    ret += "[";
+    for (size_t i = 0; i < n; i++) {
+        ret += i ? ",{\"subject\":\"" : "{\"subject\":\"";
+        ret += profile_summary(i) + "\"}";
+    }
+    ret += "]";
+    return ret;
+}
+
+bool profile_sweep_size(esphome::display::Display& it, size_t n, std::time_t nowt, std::vector<std::time_t>& calendar,
+                        uint8_t now_month, uint8_t now_mday, uint8_t now_wday) {
+    std::vector<CalendarEvent> events;
+    std::vector<Forecast> forecast_hourly;
+    std::vector<Forecast> forecast_daily;
+    std::vector<std::string> tasks;
+
+    if (!profile_fits("sweep.extract_calendar", n, n * profile_calendar_event_bytes)) { return false; }
+    std::string json = profile_calendar_json(n, calendar.front(), calendar.back());
+    profile_begin("sweep.extract_calendar");
+    events = extract_json_calendar_events(json);
+    profile_end(events.size(), json.length());
+    if (!profile_check(n, events.size())) { return false; }
+    esphome::App.feed_wdt();
+
+    std::string().swap(json);
+    if (!profile_fits("sweep.extract_forecast_hourly", n, n * profile_forecast_bytes)) { return false; }
+    json = profile_forecast_json(n, nowt, 3600);
+    profile_begin("sweep.extract_forecast_hourly");
+    forecast_hourly = extract_json_forecast(json);
+    profile_end(forecast_hourly.size(), json.length());
+    if (!profile_check(n, forecast_hourly.size())) { return false; }
+    esphome::App.feed_wdt();
+
+    std::string().swap(json);
+    if (!profile_fits("sweep.extract_forecast_daily", n, n * profile_forecast_bytes)) { return false; }
+    json = profile_forecast_json(n, nowt, 86400);
+    profile_begin("sweep.extract_forecast_daily");
+    forecast_daily = extract_json_forecast(json);
+    profile_end(forecast_daily.size(), json.length());
+    if (!profile_check(n, forecast_daily.size())) { return false; }
+    esphome::App.feed_wdt();
+
+    std::string().swap(json);
+    if (!profile_fits("sweep.extract_tasks", n, n * profile_task_bytes)) { return false; }
+    json = profile_tasks_json(n);
+    profile_begin("sweep.extract_tasks");
+    tasks = extract_json_tasks(json);
+    profile_end(tasks.size(), json.length());
+    if (!profile_check(n, tasks.size())) { return false; }
+    std::string().swap(json);
+    esphome::App.feed_wdt();
+
+    profile_begin("sweep.render_calendar");
+    render_calendar_calendar(it, 300, 20, calendar, events, now_month, now_mday, now_wday);
+    profile_end(events.size());
+    if (!profile_check(n, events.size())) { return false; }
+    esphome::App.feed_wdt();
+
+    profile_begin("sweep.render_tasks");
+    render_tasks(it, 20, 486, nowt, calendar, events, tasks);
+    profile_end(events.size() + tasks.size());
+    if (!profile_check(2 * n, events.size() + tasks.size())) { return false; }
+    esphome::App.feed_wdt();
+
+    profile_begin("sweep.render_forecast_hourly");
+    render_weather_forecast_hourly(it, 300, 324, nowt, forecast_hourly);
+    profile_end(forecast_hourly.size());
+    if (!profile_check(n, forecast_hourly.size())) { return false; }
+
+    profile_begin("sweep.render_forecast_daily");
+    render_weather_forecast_daily(it, 20, 220, nowt, forecast_daily);
+    profile_end(forecast_daily.size());
+    if (!profile_check(n, forecast_daily.size())) { return false; }
+    esphome::App.feed_wdt();
+    return true;
+}
+
+// Runs the real extraction and render functions over synthetic payloads of growing size,
+// stops at the first size that fails the limits. Draws into the display buffer without updating the panel.
+void profile_sweep() {
+    static const size_t sizes[] = {10, 50, 100, 250, 500, 1000, 2500, 5000};
+    std::time_t nowt;
+    std::tm* now = time_tm(false, &nowt);
+    uint8_t now_month = now->tm_mon;
+    uint8_t now_mday = now->tm_mday;
+    uint8_t now_wday = now->tm_wday;
+    std::vector<std::time_t> calendar = helper_calendar_range(*now, true);
+    esphome::display::Display& it = id(inkplate_display);
+
+    size_t max_ok = 0;
+    bool ok = true;
+    for (size_t n : sizes) {
+        ESP_LOGI(TAG, "profile sweep items=%u", (unsigned)n);
+        ok = profile_sweep_size(it, n, nowt, calendar, now_month, now_mday, now_wday);
+        if (!ok) {
+            break;
+        }
+        max_ok = n;
+    }
+    it.fill(WHITE);
+    ESP_LOGI(TAG, "profile sweep result=%s max_ok_items=%u", ok ? "pass" : "fail", (unsigned)max_ok);
+}
+
+#else
+
+void profile_sweep() {
+    ESP_LOGW(TAG, "Profiling is disabled, build with -DCUSTOMCODE_PROFILE.");
+}
+
+#endif
+
 }  // namespace customcode